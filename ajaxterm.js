@@ -2,9 +2,14 @@
  * $Id: ajaxterm.js 7657 2010-11-05 04:38:48Z luigi $
  *
  *  setHTML works around an IE bug that requires content to be installed twice
- * (and still without working handlers)
+ * (and still without working handlers). Other browsers only need it once,
+ * which matters on e-ink where each assignment may redraw.
  */
-function setHTML(el, t) { if (!el) return; el.innerHTML = t; el.innerHTML = el.innerHTML; }
+function setHTML(el, t) {
+	if (!el) return;
+	el.innerHTML = t;
+	if (window.ActiveXObject) el.innerHTML = el.innerHTML;
+}
 
 ajaxterm={};
 ajaxterm.Terminal_ctor=function(id,width,height, keylen) {
@@ -20,7 +25,7 @@ ajaxterm.Terminal_ctor=function(id,width,height, keylen) {
 	    sid += alphabet.charAt(Math.round(Math.random()*l));
 	}
 
-	var query0="s="+sid+"&w="+width+"&h="+height;
+	var query0="s="+sid+"&w="+width+"&h="+height+"&d=1";
 	var query1=query0+"&c=1&k=";
 	var buf="";
 	var timeout;
@@ -29,6 +34,16 @@ ajaxterm.Terminal_ctor=function(id,width,height, keylen) {
 	var sending=0;
 	var rmax=1;
 
+	/* damage mode: one div per row, text[] is what they show */
+	var rows=[];
+	var text=[];
+	var cols=width;
+	var ccur=-1;	// cursor shown
+	var pcur=-1;	// cursor-only update not yet shown
+	var ctimeout;
+	var full=1;	// we have no screen, ask for all of it
+	var etag=null;	// generation of the screen we have
+
 	/* elements in the top bar */
 	var div=document.getElementById(id);
 	var dstat=document.createElement('pre');
@@ -102,6 +117,100 @@ ajaxterm.Terminal_ctor=function(id,width,height, keylen) {
 		queue(encodeURIComponent(p));
 	}
 
+	function screen_init(w,h) {
+		var pre=document.createElement('pre');
+		pre.className='term kindle';
+		rows=[];
+		text=[];
+		for (var i=0; i<h; i++) {
+		    rows[i]=document.createElement('div');
+		    rows[i].appendChild(document.createTextNode(''));
+		    pre.appendChild(rows[i]);
+		    text[i]='';
+		}
+		while (dterm.firstChild)
+		    dterm.removeChild(dterm.firstChild);
+		dterm.appendChild(pre);
+		cols=w;
+		ccur=-1;
+		full=1;	// the next reply may be partial, refresh all
+	}
+
+	/* redraw row i, splitting it around the cursor if needed */
+	function row_draw(i) {
+		var d=rows[i], t=text[i];
+		if (ccur<0 || Math.floor(ccur/cols)!=i) {
+		    if (d.childNodes.length==1) { // just replace the text
+			d.firstChild.nodeValue=t;
+			return;
+		    }
+		    while (d.firstChild)
+			d.removeChild(d.firstChild);
+		    d.appendChild(document.createTextNode(t));
+		    return;
+		}
+		var c=ccur%cols;
+		var sp=document.createElement('span');
+		sp.className='b1';
+		sp.appendChild(document.createTextNode(t.charAt(c) || ' '));
+		while (d.firstChild)
+		    d.removeChild(d.firstChild);
+		d.appendChild(document.createTextNode(t.substring(0,c)));
+		d.appendChild(sp);
+		d.appendChild(document.createTextNode(t.substring(c+1)));
+	}
+
+	/* move the cursor, redrawing the rows not already in dirty */
+	function cursor_set(cur,dirty) {
+		var old=ccur;
+		window.clearTimeout(ctimeout);
+		pcur=-1;
+		if (cur==ccur)
+		    return;
+		ccur=cur;
+		if (old>=0 && !dirty[Math.floor(old/cols)])
+		    row_draw(Math.floor(old/cols));
+		if (cur>=0 && !dirty[Math.floor(cur/cols)])
+		    row_draw(Math.floor(cur/cols));
+	}
+
+	/*
+	 * apply a <damage> reply: each <s r= c=> replaces part of a row.
+	 * Updates that only move the cursor are held back for a while,
+	 * so that a burst of them costs a single redraw.
+	 */
+	function damage(de) {
+		var w=parseInt(de.getAttribute('w')), h=parseInt(de.getAttribute('h'));
+		var cur=parseInt(de.getAttribute('c'));
+		var s=de.getElementsByTagName('s');
+		var dirty={}, i, r, c, v;
+
+		if (w!=cols || h!=rows.length)
+		    screen_init(w,h);
+		if (!(cur>=0 && cur<cols*rows.length))
+		    cur=-1;	// no cursor on the screen
+		if (s.length==0) {
+		    pcur=cur;
+		    window.clearTimeout(ctimeout);
+		    ctimeout=window.setTimeout(function() {
+			cursor_set(pcur,{});
+		    },300);
+		    return;
+		}
+		for (i=0; i<s.length; i++) {
+		    r=parseInt(s[i].getAttribute('r'));
+		    c=parseInt(s[i].getAttribute('c'));
+		    v=s[i].firstChild ? unescape(s[i].firstChild.nodeValue) : '';
+		    while (text[r].length<c)
+			text[r]+=' ';
+		    text[r]=text[r].substring(0,c)+v+text[r].substring(c+v.length);
+		    dirty[r]=1;
+		}
+		cursor_set(cur,dirty);
+		for (r in dirty)
+		    row_draw(r);
+	}
+
 	function update() {
 		if (sending) return;
 		sending=1;
@@ -110,31 +219,58 @@ ajaxterm.Terminal_ctor=function(id,width,height, keylen) {
 		while (keybuf.length>0) {
 		    send+=keybuf.pop();
 		}
-		var query=query1+send;
+		var query=(full ? "f=1&" : "")+query1+send;
 		if (opt_get.className=='on') {
 		    r.open("GET","u?"+query,true);
-		    if (ie) { // force a refresh
-			r.setRequestHeader("If-Modified-Since", "Sat, 1 Jan 2000 00:00:00 GMT");
-		    }
 		} else {
 		    r.open("POST","u",true);
 		}
 		r.setRequestHeader('Content-Type','application/x-www-form-urlencoded');
+		if (etag && !full)
+		    r.setRequestHeader('If-None-Match',etag);
 		r.onreadystatechange = function () {
 		    if (r.readyState!=4) return;
 		    window.clearTimeout(error_timeout);
+		    /* the server says when to poll next, and has
+		     * replied 304 if our screen is current
+		     */
+		    var hint=parseInt(r.getResponseHeader('X-Poll'));
+		    if (r.status==304) {
+			sending=0;
+			timeout=window.setTimeout(update,hint>0 ? hint : rmax);
+			return;
+		    }
 		    if (r.status!=200) {
 			debug("Connection error, status: "+r.status + ' ' + r.statusText);
+			/* retry with backoff, and ask for the whole
+			 * screen since we may have missed some
+			 */
+			full=1;
+			rmax*=2;
+			if(rmax<1000)
+			    rmax=1000;
+			if(rmax>10000)
+			    rmax=10000;
+			sending=0;
+			timeout=window.setTimeout(update,rmax);
 			return;
 		    }
+		    etag=r.getResponseHeader('ETag');
 		    if(ie) {
 			var responseXMLdoc = new ActiveXObject("Microsoft.XMLDOM");
+			responseXMLdoc.preserveWhiteSpace=true;
 			responseXMLdoc.loadXML(r.responseText);
 			de = responseXMLdoc.documentElement;
 		    } else {
 			de=r.responseXML.documentElement;
 		    }
-		    if (de.tagName=="pre") {
+		    if (de.tagName=="damage") {
+			full=0;
+			damage(de);
+			rmax=100;
+		    } else if (de.tagName=="pre") {
+			rows=[];	// back to full mode
+			full=1;
 			setHTML(dterm, unescape(r.responseText));
 			rmax=100;
 		    } else {
@@ -142,6 +278,8 @@ ajaxterm.Terminal_ctor=function(id,width,height, keylen) {
 			if(rmax>2000)
 			    rmax=2000;
 		    }
+		    if (hint>0)
+			rmax=hint;
 		    sending=0;
 		    timeout=window.setTimeout(update,rmax);
 		}
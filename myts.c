@@ -58,11 +58,17 @@ In slave2 mode it uses multiple unix pipes.
 #include <string.h>	/* strcasestr */
 /* strcasestr prototype is problematic */
 char *strcasestr(const char *haystack, const char *pneedle);
+void *memmem(const void *haystack, size_t hlen, const void *needle, size_t nlen);
 #include <pty.h>
 #else
 #include <libutil.h>	/* forkpty */
 #endif
 #include <sys/time.h>	/* gettimeofday */
+#include <sys/uio.h>	/* writev */
+#include <sys/resource.h>	/* setrlimit, struct rusage */
+#include <sys/wait.h>	/* wait4 */
+#include <dirent.h>	/* opendir, to scan /proc */
+#include <time.h>
 #include <errno.h>
 #include <sys/socket.h>
 #include <sys/mman.h>	/* PROT_READ and mmap */
@@ -75,8 +81,32 @@ char *strcasestr(const char *haystack, const char *pneedle);
 #define SMAX	256	/* keyboard queue */
 #define	ROWS	25
 #define	COLS	80
+#define	MAXROWS	80	/* largest geometry a client may ask for */
+#define	MAXCOLS	150
 #define	INBUFSZ	4096	/* GET/POST queries */
-#define	OUTBUFSZ (5*ROWS*COLS)	/* output buffer */
+/* output buffer: a full screen with every cell escaped as %xx,
+ * plus per-row tags and the headers */
+#define	OUTBUFSZ (3*MAXROWS*MAXCOLS + 32*MAXROWS + 1024)
+#define	SNAMESZ	64	/* session name and form values */
+#define	MAXBODY	(1<<30)	/* largest Content-Length or chunk we accept */
+#define	SOCKBUFSZ (INBUFSZ + OUTBUFSZ)	/* per-connection buffer */
+#define	SLABSZ	16384	/* pools grow by this much */
+#define	BUFMIN	9	/* smallest buffer class is 1<<BUFMIN bytes */
+#define	NBUFCLASS 8	/* buffer classes, up to 1<<(BUFMIN+NBUFCLASS-1) */
+#define	POLL_MIN 100	/* ms, poll hint for a busy session */
+#define	POLL_BUSY 1000	/* ms, a session is busy if it had output this recently */
+
+/* states of the request parser, see parse_msg() */
+enum {
+	PS_HEADER = 0,	/* request line and headers, kept in inbuf */
+	PS_BODY,	/* Content-Length body, clen bytes left */
+	PS_CSIZE,	/* chunk size line */
+	PS_CEXT,	/* chunk extension, skipped */
+	PS_CDATA,	/* chunk data, clen bytes left */
+	PS_CEND,	/* CRLF after the chunk data */
+	PS_TRAILER,	/* trailer lines after the last chunk */
+	PS_DONE,	/* request complete */
+};
 
 /* supported mime types -- suffix space mime. Default is text/plain.
  * processed by getmime(filename)
@@ -92,24 +122,56 @@ static const char *mime_types[] = {
  * struct my_sock contains support for talking to the browser.
  * It contains a buffer for receiving the incoming request,
  * hold a copy of the response, and support for an mmapped file.
- * Initially, reply = 0, len = sizeof(inbuf) and pos = 0,
+ * Initially, reply = 0, len = sizeof(inbuf) - 1 and pos = 0,
  * we accumulate data into inbuf and call parse_msg() to tell
- * whether we are done.
+ * whether we are done. The parser is incremental: scan is the
+ * first byte not examined yet, and only the headers are retained,
+ * the body is decoded as it arrives (see form_byte()).
  * During the reply phase, inbuf contains the response hdr,
  * possibly map contains the body, len = header length, body_len = body_len
  * and pos = 0. We first send the header, then toggle len = -body_len,
  * and then send the body. When done, detach the buffer.
+ * All sockets are non-blocking, pos tracks partial writes, and
+ * a connection is dropped if it is not done by deadline.
  * If filep is set, then map is a mapped file, otherwise points to
  * some other buffer and does not need to be freed.
+ * inbuf and outbuf are the two halves of one SOCKBUFSZ buffer
+ * from me->iopool.
  */
 struct my_sock {
 	struct my_sock *next;
 	int socket;		/* the network socket */
 	int reply;		/* set when replying */
 	int pos, len;		/* read position and length */
+	time_t deadline;	/* drop the connection after this */
 	struct sockaddr_in sa;	/* not used */
-	char inbuf[INBUFSZ];	/* I/O buffer */
-	char outbuf[OUTBUFSZ];	/* I/O buffer */
+	char *inbuf;		/* I/O buffer, INBUFSZ */
+	char *outbuf;		/* I/O buffer, OUTBUFSZ */
+
+	/* request parser state */
+	int pstate;		/* PS_* */
+	int scan;		/* next byte of inbuf to examine */
+	int line;		/* start of the current header line */
+	int hlen;		/* header length, body bytes go after it */
+	char *method, *resource;	/* point into inbuf */
+	unsigned int inm;	/* If-None-Match, 0 if none */
+	int clen;		/* Content-Length, then bytes left in body/chunk */
+	int chunked;		/* Transfer-Encoding: chunked */
+
+	/* urlencoded form parser for /u */
+	int fstate;		/* 0: in key, 1: in value */
+	char fkey[4];		/* current key, we only use one-letter keys */
+	int fklen;
+	char fval[SNAMESZ];	/* current value, except for k= */
+	int fvlen;
+	int pct, pctval;	/* pending %xx escape */
+	char sname[SNAMESZ];	/* s= */
+	int rows, cols;		/* h= and w= */
+	int damage;		/* d=1, reply with changes only */
+	int full;		/* f=1, client has no screen yet */
+	int nkeys;		/* keys received */
+	struct my_sess *sess;	/* session the keys go to */
+	int stalled;		/* key queue full or session stuck, do not read */
 
 	/* memory mapped file */
 	int filep;
@@ -128,15 +190,53 @@ struct my_sess {
 
 	/* screen/keyboard buf have len *pos. *pos is the next byte to send */
 	int kseq;	// need a sequence number for kb input ?
-	int klen;	/* pending input for keyboard */
+	int klen;	/* pending input for keyboard, not terminated */
 	char keys[KMAX];
 	int slen;	/* pending input for screen */
 	char sbuf[SMAX];
 
 	int rows, cols;	/* geometry */
+	int busy;	/* a reply is being sent, do not read the pty */
+	long inflight;	/* unsent reply bytes, see sess_stuck() */
+	unsigned int gen;	/* screen generation, the ETag for /u */
+	long long last_out;	/* msec of the last output from the shell */
+
+	/* accounting, reported by /stats */
+	long long bytes_in;	/* keys written to the pty */
+	long long bytes_out;	/* output read from the pty */
+	long long parse_us;	/* time spent in page_append() */
+	int throttled;		/* rounds the pty was not read, out of tokens */
+	long long cpu_ms;	/* cpu of everything the shell runs, see sess_cpu() */
+	int tokens;		/* pty bytes we may read, see sess_tokens() */
+	long long refill;	/* msec of the last refill */
 	int cur;
+	int oldcur;	/* cursor in the last reply */
+	unsigned int dgen;	/* generation of oldpage, i.e. of the last reply */
 	char *page;	/* dump of the screen */
 	char *oldpage;	/* dump of the screen */
+	int bufsz;	/* size of the buffer holding name and pages */
+
+	/* rows scrolled off the page, see page_scroll() */
+	char *hist;	/* hsize rows */
+	int hsize;
+	int hhead;	/* next row to write */
+	int hcount;	/* rows in use */
+};
+
+/*
+ * struct my_pool hands out fixed size objects. They are carved
+ * from slabs obtained with malloc(), which are never given back,
+ * and freed objects are kept in a free list. This avoids heap
+ * fragmentation from the many short-lived connections, and lets
+ * us enforce a memory budget (see pool_get()).
+ */
+struct my_pool {
+	int size;	/* object size */
+	int total;	/* objects carved from slabs */
+	int used;	/* objects handed out */
+	void *freelist;	/* linked through the first word */
+	char *cur;	/* unused part of the last slab */
+	int left;	/* bytes in cur */
 };
 
 /*
@@ -149,8 +249,35 @@ struct my_args {
 	int lfd;	/* listener fd */
 	struct my_sock *socks;
 	struct my_sess *sess;
+
+	/* memory pools and budget */
+	struct my_pool sockpool;	/* struct my_sock */
+	struct my_pool sesspool;	/* struct my_sess */
+	struct my_pool iopool;		/* SOCKBUFSZ connection buffers */
+	struct my_pool bufpool[NBUFCLASS]; /* power of 2 buffers */
+	long mem_used;		/* bytes in slabs */
+	long max_memory;	/* 0 means no limit */
+	int max_sessions;	/* 0 means no limit */
+	int history;		/* rows of history per session */
+	int nsocks;		/* active connections */
+
+	/* slow client protection */
+	int timeout;		/* seconds to receive a request or send a reply */
+	long max_inflight;	/* unsent reply bytes per session before we hold its requests */
+	time_t now;		/* updated at each select() */
+	long long msec;		/* same, in milliseconds */
+	int max_poll;		/* ms, longest poll hint for idle sessions */
+
+	/* limits for the child shells */
+	int pty_rate;		/* bytes/s read from each pty, 0 means no limit */
+	int rlimit_cpu;		/* RLIMIT_CPU seconds */
+	long rlimit_as;		/* RLIMIT_AS bytes */
+	char *cgroup;		/* cgroup v2 directory, each shell gets <cgroup>/<pid> */
+	int cgroup_cpu;		/* cpu.max of each shell's cgroup, % of a cpu */
+	long cgroup_mem;	/* memory.max of each shell's cgroup, bytes */
 	int cycles;
 	int unsafe;	/* allow read all file systems */
+	int admin;	/* serve /stats and /search, which see all sessions */
 	int verbose;	/* allow read all file systems */
 };
 
@@ -160,6 +287,90 @@ int myerr(const char *s)
     exit(2);
 }
 
+void pool_init(struct my_pool *p, int size)
+{
+    bzero(p, sizeof(*p));
+    p->size = (size + 15) & ~15;	/* keep objects aligned */
+}
+
+/*
+ * Return an object from the pool, or NULL if growing the pool
+ * would exceed me->max_memory. The content is undefined, see
+ * pool_get() for a zeroed one.
+ */
+void *pool_alloc(struct my_args *me, struct my_pool *p)
+{
+    void *o = p->freelist;
+    int slab;
+
+    if (o) {
+	p->freelist = *(void **)o;
+    } else {
+	if (p->left < p->size) {	/* need a new slab */
+	    slab = (SLABSZ / p->size) * p->size;
+	    if (slab == 0)
+		slab = p->size;
+	    if (me->max_memory && me->mem_used + slab > me->max_memory)
+		return NULL;
+	    p->cur = malloc(slab);
+	    if (!p->cur) {
+		p->left = 0;
+		return NULL;
+	    }
+	    p->left = slab;
+	    me->mem_used += slab;
+	}
+	o = p->cur;
+	p->cur += p->size;
+	p->left -= p->size;
+	p->total++;
+    }
+    p->used++;
+    return o;
+}
+
+/* same as pool_alloc(), zeroed */
+void *pool_get(struct my_args *me, struct my_pool *p)
+{
+    void *o = pool_alloc(me, p);
+
+    if (o)
+	bzero(o, p->size);
+    return o;
+}
+
+void pool_put(struct my_pool *p, void *o)
+{
+    *(void **)o = p->freelist;
+    p->freelist = o;
+    p->used--;
+}
+
+/* buffer class for len bytes, or -1 if too large */
+int buf_class(int len)
+{
+    int i;
+
+    for (i = 0; i < NBUFCLASS; i++) {
+	if (len <= (1 << (BUFMIN + i)))
+	    return i;
+    }
+    return -1;
+}
+
+/* buffers of variable size come from the pool of the next power of 2 */
+char *buf_get(struct my_args *me, int len)
+{
+    int i = buf_class(len);
+
+    return i < 0 ? NULL : pool_get(me, &me->bufpool[i]);
+}
+
+void buf_put(struct my_args *me, char *buf, int len)
+{
+    pool_put(&me->bufpool[buf_class(len)], buf);
+}
+
 /* convert the html encoding back to plain ascii
  * XXX must be fixed to handle UTF8
  */
@@ -180,6 +391,25 @@ char *unescape(char *s)
     return s;
 }
 
+/*
+ * scroll the page up one row. The top row goes into the history,
+ * a ring of hsize rows of cols bytes each, used by /search.
+ */
+void page_scroll(struct my_sess *sh)
+{
+    int pagelen = sh->rows * sh->cols;
+
+    if (sh->hsize) {
+	memcpy(sh->hist + sh->hhead * sh->cols, sh->page, sh->cols);
+	if (++sh->hhead == sh->hsize)
+	    sh->hhead = 0;
+	if (sh->hcount < sh->hsize)
+	    sh->hcount++;
+    }
+    memmove(sh->page, sh->page + sh->cols, pagelen - sh->cols);
+    memset(sh->page + pagelen - sh->cols, ' ', sh->cols);
+}
+
 /*
  * append a string to a page, interpreting ANSI sequences
  */
@@ -193,8 +423,7 @@ char *page_append(struct my_sess *sh, char *s)
 	if (sh->cur >= pagelen) {
 	    // fprintf(stderr, "+++ scroll at %d / %d +++\n", sh->cur, pagelen);
 	    sh->cur = pagelen - sh->cols;
-	    memcpy(sh->page, sh->page + sh->cols, sh->cur);
-	    memset(sh->page + pagelen - sh->cols, ' ', sh->cols);
+	    page_scroll(sh);
 	}
 	curcol = sh->cur % sh->cols;
 	/* now should map actions */
@@ -205,11 +434,10 @@ char *page_append(struct my_sess *sh, char *s)
 	    if (sh->cur >= pagelen) { // XXX not sure if needed
 		// fprintf(stderr, "+++ scroll2 at %d / %d +++\n", sh->cur, pagelen);
 		sh->cur -= sh->cols;
-		memcpy(sh->page, sh->page + sh->cols, sh->cur);
-		memset(sh->page + pagelen - sh->cols, ' ', sh->cols);
+		page_scroll(sh);
 	    }
 	} else if (c == '\t') {
-	    if (curcol >= pagelen - 8)
+	    if (curcol >= sh->cols - 8)
 		sh->cur += (sh->cols - 1 - curcol);
 	    else
 		sh->cur += 8 - (sh->cur % 8);
@@ -302,7 +530,78 @@ notfound:
     return s;
 }
 
-int forkchild(struct my_sess *s, char *cmd)
+/* write val to the cgroup v2 control file dir/file, -1 on error */
+int cgroup_write(const char *dir, const char *file, const char *val)
+{
+    char path[256];
+    int fd, l = strlen(val);
+
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    fd = open(path, O_WRONLY);
+    if (fd < 0 || write(fd, val, l) != l) {
+	perror(path);
+	if (fd >= 0)
+	    close(fd);
+	return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/*
+ * Enable the controllers for the per-shell caps in the children
+ * of --cgroup. The shells each go in a child, so the directory
+ * itself has no processes, as cgroup v2 requires.
+ */
+void cgroup_init(struct my_args *me)
+{
+    if (me->cgroup_cpu)
+	cgroup_write(me->cgroup, "cgroup.subtree_control", "+cpu\n");
+    if (me->cgroup_mem)
+	cgroup_write(me->cgroup, "cgroup.subtree_control", "+memory\n");
+}
+
+/*
+ * Apply the limits to the child before exec. Errors are not fatal,
+ * we would rather have a shell without limits than no shell.
+ * With --cgroup each shell gets a cgroup of its own, <cgroup>/<pid>,
+ * so the caps apply per session and cpu.stat accounts for all it runs.
+ */
+void child_limits(struct my_args *me)
+{
+    struct rlimit rl;
+
+    if (me->rlimit_cpu) {
+	rl.rlim_cur = rl.rlim_max = me->rlimit_cpu;
+	if (setrlimit(RLIMIT_CPU, &rl))
+	    perror("setrlimit cpu");
+    }
+    if (me->rlimit_as) {
+	rl.rlim_cur = rl.rlim_max = me->rlimit_as;
+	if (setrlimit(RLIMIT_AS, &rl))
+	    perror("setrlimit as");
+    }
+    if (me->cgroup) {
+	char dir[256], val[64];
+
+	snprintf(dir, sizeof(dir), "%s/%d", me->cgroup, (int)getpid());
+	if (mkdir(dir, 0755) && errno != EEXIST) {
+	    perror(dir);
+	    return;
+	}
+	if (me->cgroup_cpu) {	/* quota and period in us */
+	    snprintf(val, sizeof(val), "%d 100000\n", me->cgroup_cpu * 1000);
+	    cgroup_write(dir, "cpu.max", val);
+	}
+	if (me->cgroup_mem) {
+	    snprintf(val, sizeof(val), "%ld\n", me->cgroup_mem);
+	    cgroup_write(dir, "memory.max", val);
+	}
+	cgroup_write(dir, "cgroup.procs", "0\n");	/* 0 moves the writer */
+    }
+}
+
+int forkchild(struct my_args *me, struct my_sess *s)
 {
     struct winsize ws;
 
@@ -316,107 +615,432 @@ int forkchild(struct my_sess *s, char *cmd)
 	return 1;
     }
     if (s->pid == 0) {	/* execvp the shell */
-	char *av[] = { cmd, NULL};
+	char *av[] = { me->cmd, NULL};
+	child_limits(me);
 	execvp(av[0], av);
 	exit(1);
     }
+    fcntl(s->master, F_SETFD, 1);	// close on exec
+    fcntl(s->master, F_SETFL, O_NONBLOCK);
     return 0;
 }
 
-int u_mode(struct my_args *me, struct my_sock *ss, char *body)
+/* read a small file into buf, nul terminated; returns the length or -1 */
+int read_small(const char *path, char *buf, int len)
 {
-	/* ajaxterm parameters */
-	char *s = NULL, *w = NULL, *h = NULL, *c = NULL, *k = NULL;
-	char *cur, *p, *p2;
-	struct timeval t;
-	char tmp[ROWS*COLS+1];
-	char *src, *dst;
-	char done;
-	int i, l, rows = 0, cols = 0;
-	struct my_sess *sh = NULL;
-
-	for (p = body; (cur = strsep(&p, "&")); ) {
-	    if (!*cur) continue;
-	    p2 = strsep(&cur, "=");
-	    if (!strcmp(p2, "s")) s = cur;
-	    if (!strcmp(p2, "w")) w = cur;
-	    if (!strcmp(p2, "h")) h = cur;
-	    if (!strcmp(p2, "c")) c = cur;
-	    if (!strcmp(p2, "k")) k = cur;
-	}
-	if (!s || !*s)
-	    goto error;
-	if (w) cols = atoi(w);
-	if (cols < 10 || cols > 150) cols = 80;
-	if (h) rows = atoi(h);
-	if (rows < 4 || rows > 80) rows = 25;
-
-	for (i = 0, sh = me->sess; sh; sh = sh->next, i++) {
-	    // fprintf(stderr, "at %p have %s\n", sh, sh->name);
-	    if (!strcmp(s, sh->name))
-		break;
+    int fd, l;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+	return -1;
+    l = read(fd, buf, len - 1);
+    close(fd);
+    if (l < 0)
+	return -1;
+    buf[l] = '\0';
+    return l;
+}
+
+/*
+ * Set cpu_ms for every session, -1 if we cannot tell.
+ * With --cgroup, the usage_usec in each shell's cpu.stat covers
+ * everything it runs. Otherwise one pass over /proc adds up the
+ * processes in the shell's session (forkpty() makes the shell a
+ * session leader, so the sid is its pid): each brings its own time
+ * and that of the children it has reaped. Processes that left the
+ * session, or were reaped by init, are missed.
+ */
+void sess_cpu(struct my_args *me)
+{
+    struct my_sess *sh;
+#ifdef linux
+    char buf[512], *s;
+    unsigned long ut, st;
+    long cut, cst, hz = sysconf(_SC_CLK_TCK);
+    int sid;
+    DIR *d;
+    struct dirent *e;
+
+    for (sh = me->sess; sh; sh = sh->next) {
+	sh->cpu_ms = me->cgroup ? -1 : 0;
+	if (!me->cgroup)
+	    continue;
+	snprintf(buf, sizeof(buf), "%s/%d/cpu.stat", me->cgroup, sh->pid);
+	if (read_small(buf, buf, sizeof(buf)) > 0 &&
+		(s = strstr(buf, "usage_usec ")))
+	    sh->cpu_ms = strtoll(s + 11, NULL, 10) / 1000;
+    }
+    if (me->cgroup)
+	return;
+    if (!(d = opendir("/proc")))
+	goto unknown;
+    while ((e = readdir(d))) {
+	if (!isdigit((unsigned char)e->d_name[0]))
+	    continue;
+	snprintf(buf, sizeof(buf), "/proc/%s/stat", e->d_name);
+	if (read_small(buf, buf, sizeof(buf)) <= 0)
+	    continue;	/* it went away */
+	/* session is field 6, utime to cstime are 14 to 17,
+	 * counting from the pid and after the (comm)
+	 */
+	s = strrchr(buf, ')');
+	if (!s || sscanf(s + 2, "%*c %*d %*d %d %*d %*d %*u %*u %*u %*u %*u"
+		" %lu %lu %ld %ld", &sid, &ut, &st, &cut, &cst) != 5)
+	    continue;
+	for (sh = me->sess; sh && sh->pid != sid; sh = sh->next) ;
+	if (sh)		/* in ticks for now, unsigned long can be 32 bits */
+	    sh->cpu_ms += (unsigned long long)ut + st + cut + cst;
+    }
+    closedir(d);
+    for (sh = me->sess; sh; sh = sh->next)
+	sh->cpu_ms = sh->cpu_ms * 1000 / hz;
+    return;
+unknown:
+#endif
+    for (sh = me->sess; sh; sh = sh->next)
+	sh->cpu_ms = -1;
+}
+
+/* short error reply, the connection is closed after it */
+int http_error(struct my_sock *s, int code, const char *msg)
+{
+	s->reply = 1;
+	s->stalled = 0;
+	s->pos = 0;
+	s->body_len = 0;
+	s->len = sprintf(s->outbuf,
+	    "HTTP/1.1 %d %s\r\n"
+	    "Content-Type: text/plain\r\n\r\n%s\n", code, msg, msg);
+	return 0;
+}
+
+void sess_free(struct my_args *me, struct my_sess *sh)
+{
+	if (sh->hist) {
+	    free(sh->hist);
+	    me->mem_used -= sh->hsize * sh->cols;
 	}
-	if (!sh) {
-	    // fprintf(stderr, "--- session %s not found %d\n", s, i);
-	    int l1 = rows * cols + 1;
-	    int l2 = strlen(s) + 1;
-	    int pagelen = rows*cols;
-	    sh = calloc(1, sizeof(*sh) + l1*2 + l2);
-	    if (!sh)
-		goto error;
-	    sh->rows = rows;
-	    sh->cols = cols;
-	    sh->cur = 0;
-
-	    sh->name = (char *)(sh + 1);
-	    sh->page = sh->name + l2;
-	    sh->oldpage = sh->page + l1;
-	    memset(sh->page, ' ', pagelen);
-	    strcpy(sh->name, s);
-	    sh->next = me->sess;
-	    me->sess = sh;
-	    if (forkchild(sh, me->cmd)) {
-		ss->len = sprintf(ss->outbuf,
-		    "HTTP/1.1 400 fork failed\r\n\r\n");
-		return 0;
+	buf_put(me, sh->name, sh->bufsz);
+	pool_put(&me->sesspool, sh);
+}
+
+/*
+ * Find the session with the given name, or create it and
+ * fork the child. Returns NULL on failure.
+ */
+struct my_sess *sess_find(struct my_args *me, char *name, int rows, int cols)
+{
+	struct my_sess *sh;
+	int l1, l2, pagelen;
+
+	for (sh = me->sess; sh; sh = sh->next) {
+	    if (!strcmp(name, sh->name))
+		return sh;
+	}
+	if (me->max_sessions && me->nsess >= me->max_sessions) {
+	    fprintf(stderr, "session limit %d reached\n", me->max_sessions);
+	    return NULL;
+	}
+	if (cols < 10 || cols > MAXCOLS) cols = COLS;
+	if (rows < 4 || rows > MAXROWS) rows = ROWS;
+	pagelen = rows*cols;
+	l1 = pagelen + 1;
+	l2 = strlen(name) + 1;
+	sh = pool_get(me, &me->sesspool);
+	if (!sh)
+	    goto nomem;
+	sh->bufsz = l1*2 + l2;
+	sh->name = buf_get(me, sh->bufsz);
+	if (!sh->name) {
+	    pool_put(&me->sesspool, sh);
+	    goto nomem;
+	}
+	sh->rows = rows;
+	sh->cols = cols;
+	sh->cur = 0;
+	sh->gen = 1;
+	sh->last_out = me->msec;
+
+	sh->page = sh->name + l2;
+	sh->oldpage = sh->page + l1;
+	memset(sh->page, ' ', pagelen);
+	strcpy(sh->name, name);
+	/* the history is large, it comes from malloc but within budget */
+	l1 = me->history * cols;
+	if (l1 && (!me->max_memory || me->mem_used + l1 <= me->max_memory))
+	    sh->hist = malloc(l1);
+	if (sh->hist) {
+	    sh->hsize = me->history;
+	    me->mem_used += l1;
+	} else if (l1) {
+	    fprintf(stderr, "no memory for history of %s\n", name);
+	}
+	sh->refill = me->msec;
+	if (forkchild(me, sh)) {
+	    sess_free(me, sh);
+	    return NULL;
+	}
+	sh->next = me->sess;
+	me->sess = sh;
+	me->nsess++;
+	return sh;
+
+nomem:
+	fprintf(stderr, "no memory for session %s\n", name);
+	return NULL;
+}
+
+/*
+ * resolve the session for a request from the s= w= h= values seen so far.
+ * Returns -1 for a bad request, -2 if the session cannot be created.
+ */
+int form_sess(struct my_args *me, struct my_sock *ss)
+{
+	if (!ss->sname[0])
+	    return -1;	/* k= before s= */
+	ss->sess = sess_find(me, ss->sname, ss->rows, ss->cols);
+	return ss->sess ? 0 : -2;
+}
+
+/* error reply for a failed form_byte() or form_end() */
+int form_error(struct my_sock *ss, int ret)
+{
+	if (ret == -2)
+	    return http_error(ss, 503, "Service Unavailable");
+	return http_error(ss, 400, "Bad Request");
+}
+
+/* store a complete form value */
+void form_value(struct my_sock *ss)
+{
+	ss->fval[ss->fvlen] = '\0';
+	if (ss->fklen != 1)
+	    return;
+	if (ss->fkey[0] == 's')
+	    strcpy(ss->sname, ss->fval);
+	else if (ss->fkey[0] == 'w')
+	    ss->cols = atoi(ss->fval);
+	else if (ss->fkey[0] == 'h')
+	    ss->rows = atoi(ss->fval);
+	else if (ss->fkey[0] == 'd')
+	    ss->damage = atoi(ss->fval);
+	else if (ss->fkey[0] == 'f')
+	    ss->full = atoi(ss->fval);
+}
+
+/*
+ * Feed one byte of an urlencoded form (the /u query) to the parser.
+ * Values for k= are decoded straight into the session keyboard queue.
+ * Returns 0 if the byte was consumed, < 0 on error, and 1 if the
+ * queue is full: the byte is not consumed and must be fed again later.
+ * If canstall is 0 we drop keys instead, as the old code did.
+ */
+int form_byte(struct my_args *me, struct my_sock *ss, int c, int canstall)
+{
+	static const char *hex = "0123456789abcdef0123456789ABCDEF";
+	int pct = ss->pct, val = ss->pctval, ret;
+	char *d;
+
+	if (ss->fstate == 0) {	/* in key, no escapes expected */
+	    if (c == '=') {
+		ss->fstate = 1;
+		ss->fvlen = 0;
+		ss->pct = 0;
+	    } else if (c == '&') {
+		ss->fklen = 0;
+	    } else if (ss->fklen < (int)sizeof(ss->fkey) - 1) {
+		ss->fkey[ss->fklen++] = c;
+	    }
+	    return 0;
+	}
+	if (c == '&') {
+	    form_value(ss);
+	    ss->fstate = 0;
+	    ss->fklen = 0;
+	    return 0;
+	}
+	if (pct) {	/* in a %xx escape */
+	    if (!c || !(d = index(hex, c))) {
+		pct = 0;	/* invalid escape, drop it */
+		goto done;
+	    }
+	    val = val*16 + ((d - hex) & 0xf);
+	    if (--pct)
+		goto done;
+	    c = val;
+	} else if (c == '%') {
+	    pct = 2;
+	    val = 0;
+	    goto done;
+	} else if (c == '+') {
+	    c = ' ';
+	}
+	if (ss->fklen == 1 && ss->fkey[0] == 'k') {
+	    if (!ss->sess && (ret = form_sess(me, ss)))
+		return ret;
+	    if (ss->sess->klen < KMAX) {
+		ss->sess->keys[ss->sess->klen++] = c;
+		ss->nkeys++;
+	    }
+	    else if (canstall)
+		return 1;	/* state is not updated */
+	} else if (ss->fvlen < (int)sizeof(ss->fval) - 1) {
+	    ss->fval[ss->fvlen++] = c;
+	} else if (ss->fklen == 1 && ss->fkey[0] == 's') {
+	    return -1;	/* session name too long */
+	}
+done:
+	ss->pct = pct;
+	ss->pctval = val;
+	return 0;
+}
+
+/* end of the form, complete the last value and find the session */
+int form_end(struct my_args *me, struct my_sock *ss)
+{
+	if (ss->fstate == 1)
+	    form_value(ss);
+	ss->fstate = 0;
+	if (!ss->sess && ss->sname[0])
+	    return form_sess(me, ss);
+	return 0;
+}
+
+/*
+ * Suggested delay before the next poll. A session that had output
+ * recently, or just got keys, will likely have more soon. After
+ * that the delay grows with the idle time, up to me->max_poll.
+ */
+int poll_hint(struct my_args *me, struct my_sock *ss, struct my_sess *sh)
+{
+	long long idle = me->msec - sh->last_out;
+
+	if (ss->nkeys || idle < POLL_BUSY)
+	    return POLL_MIN;
+	idle /= 4;
+	if (idle < POLL_MIN)
+	    return POLL_MIN;
+	return idle > me->max_poll ? me->max_poll : (int)idle;
+}
+
+/*
+ * Headers for the replies to /u. The ETag is the screen generation,
+ * so a client that already has it gets a 304 with no body, and
+ * X-Poll is the poll_hint() in milliseconds.
+ */
+int u_header(struct my_args *me, struct my_sock *ss, struct my_sess *sh, int code)
+{
+	char *dst = ss->outbuf;
+
+	dst += sprintf(dst, "HTTP/1.1 %s\r\n"
+	    "Cache-Control: no-cache\r\n",
+	    code == 304 ? "304 Not Modified" : "200 OK");
+	if (sh)
+	    dst += sprintf(dst, "ETag: \"%u\"\r\nX-Poll: %d\r\n",
+		sh->gen, poll_hint(me, ss, sh));
+	if (code != 304)
+	    dst += sprintf(dst, "Content-Type: text/xml\r\n");
+	dst += sprintf(dst, "\r\n");
+	return dst - ss->outbuf;
+}
+
+/*
+ * Damage mode for e-ink displays, where redrawing is expensive.
+ * For each row that changed since the last reply we send the span
+ * from the first to the last modified cell, as <s r="row" c="col">,
+ * so the client only touches those text nodes. If only the cursor
+ * moved there are no spans, and the client may delay the update.
+ * f=1 from the client means it has no screen, send everything.
+ */
+int u_damage(struct my_args *me, struct my_sock *ss, struct my_sess *sh)
+{
+	int r, a, b, rows = sh->rows, cols = sh->cols;
+	int c = sh->cur;
+	unsigned char *cur, *old;
+	char *dst;
+
+	if (ss->full)
+	    memset(sh->oldpage, '\0', rows*cols);
+	if (c < 0 || c >= rows*cols)
+	    c = -1;	/* off the page, no cursor */
+	dst = ss->outbuf + u_header(me, ss, sh, 200);
+	dst += sprintf(dst,
+	    "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>"
+	    "<damage c=\"%d\" w=\"%d\" h=\"%d\">", c, cols, rows);
+	for (r = 0; r < rows; r++) {
+	    cur = (unsigned char *)sh->page + r*cols;
+	    old = (unsigned char *)sh->oldpage + r*cols;
+	    for (a = 0; a < cols && cur[a] == old[a]; a++) ;
+	    if (a == cols)
+		continue;	/* row unchanged */
+	    for (b = cols; cur[b - 1] == old[b - 1]; b--) ;
+	    dst += sprintf(dst, "<s r=\"%d\" c=\"%d\">", r, a);
+	    for (; a < b; a++) {
+		if (isalnum(cur[a]) || cur[a] == ' ')
+		    *dst++ = cur[a];
+		else
+		    dst += sprintf(dst, "%%%02x", cur[a]);
 	    }
+	    dst += sprintf(dst, "</s>");
 	}
-	unescape(k);
-	strncat(sh->keys + sh->klen, k, sizeof(sh->keys) - 1 - sh->klen);
-	sh->klen = strlen(sh->keys);
+	dst += sprintf(dst, "</damage>");
+	ss->len = dst - ss->outbuf;
+	memcpy(sh->oldpage, sh->page, rows*cols);
+	sh->oldcur = sh->cur;
+	sh->dgen = sh->gen;
+	if (me->verbose) fprintf(stderr, "response %s\n", ss->outbuf);
+	return 0;
+}
+
+/*
+ * Build the reply to an ajax request, i.e. the screen for session sh,
+ * or a short <idem> if the screen has not changed.
+ */
+int u_reply(struct my_args *me, struct my_sock *ss, struct my_sess *sh)
+{
+	char *src, *dst;
+	char done;
+	int i, l, rows, cols;
 
+	if (!sh)
+	    goto same;
+	if (ss->inm == sh->gen && !ss->full) {	/* client is up to date */
+	    ss->len = u_header(me, ss, sh, 304);
+	    if (me->verbose) fprintf(stderr, "response %s\n", ss->outbuf);
+	    return 0;
+	}
+	/* damage replies are relative to oldpage; if the client does not
+	 * have it (a reply was lost) it must get the whole screen.
+	 */
+	if (ss->inm && ss->inm != sh->dgen)
+	    ss->full = 1;
+	if (ss->damage && (ss->full || sh->cur != sh->oldcur ||
+		memcmp(sh->page, sh->oldpage, sh->rows*sh->cols)))
+	    return u_damage(me, ss, sh);
 	rows = sh->rows;
 	cols = sh->cols;
 	src = sh->page;
 	sh->page[rows*cols] = '\0';	// ensure it is terminated XXX bug in cursor handling
-	if (!strcmp(sh->page, sh->oldpage)) {
+	/* <idem> only if the client has what we sent last time,
+	 * otherwise it would keep a stale screen under the new ETag.
+	 */
+	if (!ss->full && !strcmp(sh->page, sh->oldpage)) {
 	    /* no modifications, compact version */
+	    sh->dgen = sh->gen;
 same:
-	    ss->len = sprintf(ss->outbuf,
-		"HTTP/1.1 200 OK\r\n"
-		"Content-Type: text/xml\r\n\r\n"
+	    ss->len = u_header(me, ss, sh, 200);
+	    ss->len += sprintf(ss->outbuf + ss->len,
 		"<?xml version=\"1.0\" ?>"
 		"<idem></idem>");
 	    if (me->verbose) fprintf(stderr, "response %s\n", ss->outbuf);
 	    return 0;
-	} else {
-	    strcpy(sh->oldpage, sh->page);
 	}
-	goto good;
+	strcpy(sh->oldpage, sh->page);
+	sh->oldcur = sh->cur;
+	sh->dgen = sh->gen;
 
-error:
-	goto same;
-	rows = ROWS;
-	cols = COLS;
-	gettimeofday(&t, NULL);
-	l = sprintf(tmp, "session %p at %d.%06d pressed %s",
-		ss, (int)t.tv_sec, (int)(t.tv_usec), k);
-	src = tmp;
-
-good:
-	ss->len = sprintf(ss->outbuf,
-            "HTTP/1.1 200 OK\r\n"
-            "Content-Type: text/xml\r\n\r\n"
+	ss->len = u_header(me, ss, sh, 200);
+	ss->len += sprintf(ss->outbuf + ss->len,
 	    "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>"
 	    "<pre class=\"term kindle\">");
 	done = '\0';
@@ -424,13 +1048,13 @@ good:
 	for (i=0, dst = ss->outbuf + ss->len; i < rows*cols;) {
 	    char cc = done ? done : src[i];
 	    if (!cc) done = cc = ' ';
-	    if (sh && src == sh->page && i == sh->cur)
+	    if (i == sh->cur)
 		dst += sprintf(dst, "<span class=\"b1\">");
 	    if (isalnum(cc) || cc == ' ') // XXX
 		    *dst++ = cc;
 	    else
-		dst += sprintf(dst, "%%%02x", cc);
-	    if (sh && src == sh->page && i == sh->cur)
+		dst += sprintf(dst, "%%%02x", (unsigned char)cc);
+	    if (i == sh->cur)
 		dst += sprintf(dst, "</span>");
 	    if (++i % cols == 0)
 		*dst++ = '\n';
@@ -441,6 +1065,33 @@ good:
 	return 0;
 }
 
+/*
+ * ajax request using GET, the form is in the query string.
+ * Decode it as if it were the body, then continue as for POST.
+ */
+int u_mode(struct my_args *me, struct my_sock *ss, char *query)
+{
+	int ret;
+
+	for (; *query; query++) {
+	    if ((ret = form_byte(me, ss, (unsigned char)*query, 0)) < 0)
+		return ret;
+	}
+	ss->pstate = PS_DONE;
+	return 0;
+}
+
+/*
+ * A session is stuck if its replies in flight exceed --max-inflight:
+ * the client is not taking them, so we hold its next requests (and
+ * with busy set, its pty) rather than build more replies for it.
+ * Other sessions are not affected.
+ */
+int sess_stuck(struct my_args *me, struct my_sess *sh)
+{
+	return sh && me->max_inflight && sh->inflight >= me->max_inflight;
+}
+
 /*
  * HTTP support
  */
@@ -455,6 +1106,7 @@ int opensock(struct sockaddr_in sa)
 	return -1;
     }
     fcntl(fd, F_SETFD, 1 );	// close on exec
+    fcntl(fd, F_SETFL, O_NONBLOCK);
     i = 1;
     if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &i, sizeof(i) ) < 0 ) {
 	perror(" cannot reuseaddr");
@@ -472,6 +1124,35 @@ int opensock(struct sockaddr_in sa)
     return fd;
 }
 
+/* a connection ready to receive a request, NULL if over budget */
+struct my_sock *sock_new(struct my_args *me, int fd)
+{
+    struct my_sock *s;
+
+    s = pool_get(me, &me->sockpool);
+    /* not zeroed, both halves are written before they are read */
+    if (s && !(s->inbuf = pool_alloc(me, &me->iopool))) {
+	pool_put(&me->sockpool, s);
+	s = NULL;
+    }
+    if (!s)
+	return NULL;
+    s->outbuf = s->inbuf + INBUFSZ;
+    s->socket = fd;
+    s->filep = -1;	/* no file */
+    s->pos = 0;
+    s->len = INBUFSZ - 1;	/* room for a terminator */
+    s->clen = -1;	/* no Content-Length yet */
+    s->deadline = me->now + me->timeout;
+    return s;
+}
+
+void sock_free(struct my_args *me, struct my_sock *s)
+{
+    pool_put(&me->iopool, s->inbuf);
+    pool_put(&me->sockpool, s);
+}
+
 int handle_listen(struct my_args *me)
 {
     int fd;
@@ -484,22 +1165,26 @@ int handle_listen(struct my_args *me)
     l = sizeof(sa);
     fd = accept(me->lfd, (struct sockaddr *)&sa, &l);
     if (fd < 0) {
-	fprintf(stderr, "listen failed\n");
+	if (errno != EAGAIN && errno != EINTR)
+	    fprintf(stderr, "listen failed\n");
 	return -1;
     }
-    s = calloc(1, sizeof(*s));
-    if (!s) {
+    fcntl(fd, F_SETFD, 1);	// close on exec
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    s = sock_new(me, fd);
+    if (!s) {	/* over budget, refuse the connection */
+	static const char busy[] =
+	    "HTTP/1.1 503 Service Unavailable\r\n\r\n";
+	if (write(fd, busy, sizeof(busy) - 1) < 0)	/* best effort */
+	    perror("503 reply");
 	close(fd);
 	fprintf(stderr, "alloc failed\n");
 	return -1;
     }
     s->sa = sa;
-    s->socket = fd;
-    s->filep = -1;	/* no file */
-    s->pos = 0;
-    s->len = sizeof(s->inbuf);
     s->next = me->socks;
     me->socks = s;
+    me->nsocks++;
     return 0;
 }
 
@@ -521,64 +1206,234 @@ const char *getmime(const char *res)
 }
 
 /*
- * A stripped down parser for http, which also interprets what
- * we need to do.
+ * report memory and pool occupancy, and per-session accounting.
+ * Sessions are listed by pid, their names are the keys to the shells.
  */
-int parse_msg(struct my_args *me, struct my_sock *s)
+int stats_reply(struct my_args *me, struct my_sock *s)
 {
-    char *a, *b, *c = s->inbuf;	/* strsep support */
-    char *body, *method = NULL, *resource = NULL;
-    int row, tok;
-    int clen = -1;
-    char *err = "generic error";
+    char *dst = s->outbuf;
+    struct my_sess *sh;
+    int i;
 
-    if (s->pos == s->len) { // buffer full, we are done
-	fprintf(stderr, "--- XXX input buffer full\n");
-	s->len = 0; // complete
-    }
-    /* locate the end of the header. If not found, just return */
-    body = strstr(s->inbuf, "\n\r\n") + 3;
-    if (body < s->inbuf) body = strstr(s->inbuf, "\n\n") + 2;
-    if (body < s->inbuf && s->len) return 0;
-    /* quick search for content length */
-    a = strcasestr(s->inbuf, "Content-length:");
-    if (a && a < body) {
-	sscanf(a + strlen("Content-length:") + 1, "%d", &clen);
-	if (me->verbose) fprintf(stderr, "content length = %d, body len %d\n",
-		clen, s->pos - (body - s->inbuf));
-	if (s->pos - (body - s->inbuf) != clen)
-		return 0;
+    dst += sprintf(dst,
+	"HTTP/1.1 200 OK\r\n"
+	"Content-Type: text/plain\r\n\r\n"
+	"memory %ld max %ld\n"
+	"sessions %d max %d\n"
+	"connections %d\n"
+	"pool\tsize\tused\ttotal\n"
+	"sock\t%d\t%d\t%d\n"
+	"sess\t%d\t%d\t%d\n"
+	"io\t%d\t%d\t%d\n",
+	me->mem_used, me->max_memory, me->nsess, me->max_sessions,
+	me->nsocks,
+	me->sockpool.size, me->sockpool.used, me->sockpool.total,
+	me->sesspool.size, me->sesspool.used, me->sesspool.total,
+	me->iopool.size, me->iopool.used, me->iopool.total);
+    for (i = 0; i < NBUFCLASS; i++) {
+	struct my_pool *p = &me->bufpool[i];
+	dst += sprintf(dst, "buf\t%d\t%d\t%d\n", p->size, p->used, p->total);
     }
-    /* no content length, hope body is complete */
-    /* XXX maybe do a multipass */
+    sess_cpu(me);
+    dst += sprintf(dst, "pid\tin\tout\tparse_us\tthrottled\tcpu_ms\n");
+    for (sh = me->sess; sh; sh = sh->next) {
+	if (s->outbuf + OUTBUFSZ - dst < 120) {
+	    dst += sprintf(dst, "...\n");
+	    break;
+	}
+	dst += sprintf(dst, "%d\t%lld\t%lld\t%lld\t%d\t%lld\n",
+	    sh->pid, sh->bytes_in, sh->bytes_out, sh->parse_us,
+	    sh->throttled, sh->cpu_ms);
+    }
+    s->len = dst - s->outbuf;
+    return 0;
+}
+
+/* state of a /search, results go into outbuf until it is full */
+struct my_search {
+    char *q;		/* the string to look for */
+    int qlen;
+    char *dst, *end;	/* output */
+    int k;		/* q[k] is rare in the block, -1 if none is */
+    int matches;
+    int truncated;
+    long bytes;		/* bytes scanned */
+};
+
+/*
+ * Set q->k to the byte of q that is rarest in the first SAMPLESZ
+ * bytes of the block, or -1 if all of them are common there.
+ */
+#define	SAMPLESZ 4096
+void search_pick(struct my_search *q, char *base, int len)
+{
+    int count[256], i, n = len < SAMPLESZ ? len : SAMPLESZ;
+    unsigned char *p = (unsigned char *)base;
+
+    bzero(count, sizeof(count));
+    for (i = 0; i < n; i++)
+	count[p[i]]++;
+    q->k = 0;
+    for (i = 1; i < q->qlen; i++) {
+	if (count[(unsigned char)q->q[i]] < count[(unsigned char)q->q[q->k]])
+	    q->k = i;
+    }
+    if (count[(unsigned char)q->q[q->k]] * 64 > n)
+	q->k = -1;
+}
+
+/*
+ * Return the leftmost match of q in [p, end), or NULL.
+ * memchr() on a rare byte is the fastest filter; when q has
+ * none, memmem() still skips ahead on mismatches.
+ */
+char *search_find(struct my_search *q, char *p, char *end)
+{
+    int k = q->k;
+    char *c;
+
+    if (k < 0)
+	return memmem(p, end - p, q->q, q->qlen);
+    while (end - p >= q->qlen) {
+	c = memchr(p + k, q->q[k], end - p - q->qlen + 1);
+	if (!c)
+	    break;
+	p = c - k;
+	if (!memcmp(p, q->q, q->qlen))
+	    return p;
+	p++;
+    }
+    return NULL;
+}
+
+/*
+ * Look for q in nrows rows of sh->cols bytes starting at base,
+ * and report each matching row once, numbered from row0.
+ * The rows are contiguous, so we scan the whole block at once.
+ * A match must not cross the end of a row; search_find() returns
+ * the leftmost one, so if it does, the rest of that row cannot
+ * match and we resume from the next one.
+ */
+void search_rows(struct my_search *q, struct my_sess *sh, char *base,
+	int nrows, int row0)
+{
+    int cols = sh->cols, off, r, l;
+    char *p, *end = base + nrows * cols;
 
-    /* now parse the header */
-    for (row=0; (b = strsep(&c, "\r\n"));) {
-	if (*b == '\0') continue;
-	if (b > body) {
-	    body = b;
+    if (q->qlen > cols)
+	return;		/* cannot fit in a row */
+    q->bytes += end - base;
+    search_pick(q, base, end - base);
+    for (p = base; p < end && !q->truncated; p = base + (r + 1) * cols) {
+	p = search_find(q, p, end);
+	if (!p)
+	    break;
+	off = p - base;
+	r = off / cols;
+	if (off % cols + q->qlen > cols)
+	    continue;	/* crosses a row */
+	if (q->end - q->dst < cols + 32) {
+	    q->truncated = 1;
 	    break;
 	}
-	row++;
-        for (tok=0; (a = strsep(&b, " \t"));) {
-	    if (*a == '\0') continue;
-	    tok++;
-	    if (row == 1) {
-		if (tok == 1) method = a;
-		if (tok == 2) resource = a;
-	    }
+	p = base + r * cols;	/* context is the row, without trailing blanks */
+	for (l = cols; l > 0 && p[l - 1] == ' '; l--) ;
+	q->dst += sprintf(q->dst, "%d\t%d\t%.*s\n", sh->pid, row0 + r, l, p);
+	q->matches++;
+    }
+}
+
+/*
+ * GET /search?q=string looks for a string in the screen and the
+ * history of all sessions. Each matching row is reported as the
+ * pid of the session's shell, row and row text, separated by tabs
+ * (session names are the keys to the shells, never show them).
+ * Only with --admin, as it reads every session. Rows 0 and up are
+ * on the screen, negative rows are in the history, -1 being the
+ * last one that scrolled off.
+ */
+int search_reply(struct my_args *me, struct my_sock *s, char *query)
+{
+    struct my_search q;
+    struct my_sess *sh;
+    struct timeval t0, t1;
+    char *p, *hdr;
+    int n;
+
+    bzero(&q, sizeof(q));
+    while ((p = strsep(&query, "&"))) {
+	if (!strncmp(p, "q=", 2))
+	    q.q = unescape(p + 2);
+    }
+    if (!q.q || !(q.qlen = strlen(q.q)))
+	return http_error(s, 400, "Bad Request");
+    gettimeofday(&t0, NULL);
+    hdr = s->outbuf + sprintf(s->outbuf,
+	"HTTP/1.1 200 OK\r\n"
+	"Content-Type: text/plain\r\n\r\n");
+    /* leave room for the summary line */
+    q.dst = hdr + 80;
+    q.end = s->outbuf + OUTBUFSZ;
+    for (sh = me->sess; sh && !q.truncated; sh = sh->next) {
+	search_rows(&q, sh, sh->page, sh->rows, 0);
+	if (!sh->hcount)
+	    continue;
+	/* the history is a ring, oldest row first */
+	n = sh->hhead - sh->hcount;
+	if (n < 0) {
+	    search_rows(&q, sh, sh->hist + (n + sh->hsize) * sh->cols,
+		-n, -sh->hcount);
+	    n = 0;
 	}
+	search_rows(&q, sh, sh->hist + n * sh->cols, sh->hhead - n,
+		n - sh->hhead);
     }
-    s->reply = 1; /* body found, we move to reply mode. */
-    if (me->verbose) fprintf(stderr, "%s %s\n", method, resource);
-    if (me->verbose) fprintf(stderr, "+++ request body [%s]\n", body);
+    gettimeofday(&t1, NULL);
+    n = sprintf(hdr, "# %d matches%s, %ld bytes in %ld us\n",
+	q.matches, q.truncated ? " (truncated)" : "", q.bytes,
+	(long)(t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec);
+    memmove(hdr + n, hdr + 80, q.dst - (hdr + 80));
+    s->len = q.dst - (80 - n) - s->outbuf;
+    return 0;
+}
+
+/*
+ * Handle a complete request: build the reply for the ajax
+ * requests, or map the file and serve it.
+ */
+int do_request(struct my_args *me, struct my_sock *s)
+{
+    char *a, *resource = s->resource;
+    char *err = "generic error";
+    int ret;
+
+    s->reply = 1; /* request complete, we move to reply mode. */
+    s->stalled = 0;
     s->pos = 0;
-    if (!strcmp(method, "POST") && !strcmp(resource, "/u")) {
-	/* this is the ajax request */
-	return u_mode(me, s, body);
-    } else if (!strcmp(method, "GET") && !strncmp(resource, "/u?", 3)) {
+    if (s->pstate != PS_DONE &&
+	    !strcmp(s->method, "GET") && !strncmp(resource, "/u?", 3)) {
 	/* same ajax request using GET */
-	return u_mode(me, s, resource+3);
+	if ((ret = u_mode(me, s, resource+3)))
+	    return form_error(s, ret);
+    }
+    if (s->pstate == PS_DONE) {
+	/* this is the ajax request, the body is already decoded */
+	if ((ret = form_end(me, s)))
+	    return form_error(s, ret);
+	if (sess_stuck(me, s->sess)) {	/* mainloop() resumes us */
+	    s->reply = 0;
+	    s->stalled = 1;
+	    return 0;
+	}
+	return u_reply(me, s, s->sess);
+    } else if (!strcmp(s->method, "GET") && !strcmp(resource, "/stats")) {
+	if (!me->admin)
+	    return http_error(s, 403, "Forbidden");
+	return stats_reply(me, s);
+    } else if (!strcmp(s->method, "GET") && !strncmp(resource, "/search?", 8)) {
+	if (!me->admin)
+	    return http_error(s, 403, "Forbidden");
+	return search_reply(me, s, resource + 8);
     } else {	/* request for a file, map and serve it */
 	struct stat sb;
 
@@ -610,60 +1465,266 @@ int parse_msg(struct my_args *me, struct my_sock *s)
 error:
     if (s->filep >= 0)
 	close(s->filep);
+    s->filep = -1;
+    s->map = NULL;
     s->len = sprintf(s->outbuf,
 	"HTTP/1.1 200 OK\r\n"
 	"Content-Type: text/plain\r\n\r\nResource %s : %s\n", resource, err);
     return 0;
 }
 
+/*
+ * Process one header line, already terminated. Returns 1 when
+ * the headers are complete, 0 if more are needed, -1 on error.
+ */
+int parse_line(struct my_args *me, struct my_sock *s, char *p)
+{
+    char *end;
+    long l;
+
+    if (!s->method) {	/* request line, method resource [version] */
+	if (!*p)
+	    return 0;	/* skip empty lines before the request */
+	s->method = p;
+	p += strcspn(p, " \t");
+	if (*p)
+	    *p++ = '\0';
+	p += strspn(p, " \t");
+	s->resource = p;
+	p += strcspn(p, " \t");
+	*p = '\0';
+	if (!*s->method || *s->resource != '/')
+	    return -1;
+	if (me->verbose) fprintf(stderr, "%s %s\n", s->method, s->resource);
+	return 0;
+    }
+    if (!*p)
+	return 1;	/* empty line, end of headers */
+    if (!strncasecmp(p, "Content-Length:", 15)) {
+	l = strtol(p + 15, &end, 10);
+	if (end == p + 15 || end[strspn(end, " \t")] || l < 0 || l > MAXBODY)
+	    return -1;
+	s->clen = l;
+	if (me->verbose) fprintf(stderr, "content length = %d\n", s->clen);
+    } else if (!strncasecmp(p, "Transfer-Encoding:", 18)) {
+	s->chunked = strcasestr(p + 18, "chunked") != NULL;
+    } else if (!strncasecmp(p, "If-None-Match:", 14)) {
+	p += 14 + strspn(p + 14, " \t");
+	if (!strncmp(p, "W/", 2))
+	    p += 2;
+	if (*p == '"')
+	    s->inm = strtoul(p + 1, NULL, 10);
+    }
+    return 0;
+}
+
+/*
+ * An incremental parser for http. It is called when new data is
+ * in inbuf, or to resume after a stall, and continues from where
+ * it stopped so each byte is examined once.
+ * The headers must fit in inbuf. The body of POST /u is decoded
+ * as it arrives, and keys are streamed into the session queue,
+ * so a large paste uses no more memory than a small one.
+ * When the queue is full we stall and mainloop() stops reading
+ * the socket until the shell has consumed some keys.
+ */
+int parse_msg(struct my_args *me, struct my_sock *s)
+{
+    char *p, *nl;
+    int c, ret;
+
+    s->stalled = 0;
+    while (s->pstate == PS_HEADER) {
+	nl = memchr(s->inbuf + s->scan, '\n', s->pos - s->scan);
+	if (!nl) {
+	    s->scan = s->pos;
+	    if (s->pos >= INBUFSZ - 1)
+		return http_error(s, 431, "Request Header Fields Too Large");
+	    return 0;
+	}
+	p = s->inbuf + s->line;
+	s->scan = s->line = nl + 1 - s->inbuf;
+	if (nl > p && nl[-1] == '\r')
+	    nl--;
+	*nl = '\0';
+	ret = parse_line(me, s, p);
+	if (ret < 0)
+	    return http_error(s, 400, "Bad Request");
+	if (ret == 0)
+	    continue;
+	/* headers complete, only POST /u needs the body */
+	s->hlen = s->scan;
+	if (strcmp(s->method, "POST") || strcmp(s->resource, "/u"))
+	    return do_request(me, s);
+	if (s->chunked) {
+	    s->pstate = PS_CSIZE;
+	    s->clen = 0;
+	} else if (s->clen > 0) {
+	    s->pstate = PS_BODY;
+	} else if (s->clen == 0) {
+	    s->pstate = PS_DONE;
+	} else {
+	    return http_error(s, 411, "Length Required");
+	}
+	/*
+	 * The headers are not needed anymore, move the body to the
+	 * start of inbuf so that each read() can use all of it.
+	 */
+	s->method = "POST";
+	s->resource = "/u";
+	s->pos -= s->scan;
+	memmove(s->inbuf, s->inbuf + s->scan, s->pos + 1);
+	s->scan = s->line = s->hlen = 0;
+    }
+
+    for (; s->scan < s->pos && s->pstate != PS_DONE; s->scan++) {
+	c = (unsigned char)s->inbuf[s->scan];
+	switch (s->pstate) {
+	case PS_BODY:
+	case PS_CDATA:
+	    ret = form_byte(me, s, c, 1);
+	    if (ret < 0)
+		return form_error(s, ret);
+	    if (ret > 0) {	/* key queue full, resume later */
+		s->stalled = 1;
+		return 0;
+	    }
+	    if (--s->clen == 0)
+		s->pstate = (s->pstate == PS_BODY) ? PS_DONE : PS_CEND;
+	    break;
+
+	case PS_CSIZE:	/* hex size, then optional extension */
+	    if (isxdigit(c)) {
+		if (s->clen > MAXBODY / 16)	/* check before it overflows */
+		    return http_error(s, 400, "Bad Request");
+		s->clen = s->clen*16 + (isdigit(c) ? c - '0' : (c|0x20) - 'a' + 10);
+		break;
+	    }
+	    if (c == ';' || c == ' ' || c == '\t') {
+		s->pstate = PS_CEXT;
+		break;
+	    }
+	    /* fallthrough */
+	case PS_CEXT:
+	    if (c == '\r' || (s->pstate == PS_CEXT && c != '\n'))
+		break;
+	    if (c != '\n')
+		return http_error(s, 400, "Bad Request");
+	    s->pstate = s->clen ? PS_CDATA : PS_TRAILER;
+	    break;
+
+	case PS_CEND:	/* CRLF after the data */
+	    if (c == '\r')
+		break;
+	    if (c != '\n')
+		return http_error(s, 400, "Bad Request");
+	    s->pstate = PS_CSIZE;
+	    break;
+
+	case PS_TRAILER:	/* clen counts bytes in the current line */
+	    if (c == '\r')
+		break;
+	    if (c != '\n')
+		s->clen++;
+	    else if (s->clen == 0)
+		s->pstate = PS_DONE;
+	    else
+		s->clen = 0;
+	    break;
+	}
+    }
+    if (s->pstate == PS_DONE)
+	return do_request(me, s);
+    /* all body bytes consumed, reuse the space after the headers */
+    s->pos = s->scan = s->hlen;
+    return 0;
+}
+
+/* close the connection and release the file, if any */
+void sock_close(struct my_args *me, struct my_sock *s)
+{
+    /* the kindle wants shutdown before close */
+    shutdown(s->socket, SHUT_RDWR);
+    close(s->socket);
+    s->len = 0;
+    if (s->filep >= 0) {
+	if (s->map) munmap(s->map, s->body_len);
+	close(s->filep);
+	s->filep = -1;
+    }
+}
+
+/* run the parser, and start the send deadline once a reply is ready */
+void sock_parse(struct my_args *me, struct my_sock *s)
+{
+    parse_msg(me, s);
+    if (s->reply)
+	s->deadline = me->now + me->timeout;
+}
+
+/* unsent reply bytes on a socket */
+int sock_pending(struct my_sock *s)
+{
+    if (!s->reply)
+	return 0;
+    return s->len > 0 ? s->len - s->pos + s->body_len : s->body_len - s->pos;
+}
+
 /*
  * Handle I/O on the socket talking to the browser.
- * We always use it in half duplex
+ * We always use it in half duplex. The socket is non-blocking,
+ * so a slow client never stalls the other sessions.
  */
 int sock_io(struct my_args *me, struct my_sock *s)
 {
+    struct iovec iov[2];
     int l;
     
     if (s->reply) {
 	/* first write the header, then set s->len negative and
-	 * write the mapped file
+	 * write the mapped file. While in the header, try to send
+	 * the body in the same call.
 	 */
 	if (s->len > 0) {
-	    l = write(s->socket, s->outbuf + s->pos, s->len - s->pos);
+	    iov[0].iov_base = s->outbuf + s->pos;
+	    iov[0].iov_len = s->len - s->pos;
+	    iov[1].iov_base = s->map;
+	    iov[1].iov_len = s->body_len;
+	    l = writev(s->socket, iov, s->body_len ? 2 : 1);
 	} else {
 	    l = write(s->socket, s->map + s->pos, s->body_len - s->pos);
 	}
+	if (l < 0 && (errno == EAGAIN || errno == EINTR))
+	    return 0;	/* try again later */
 	if (l <= 0)
 	    goto write_done;
 	s->pos += l;
         if (me->verbose) fprintf(stderr, "written1 %d/%d\n", s->pos, s->len);
-	if (s->pos == s->len) { /* header sent, move to the body */
+	if (s->len > 0 && s->pos >= s->len) { /* header sent, move to the body */
+	    s->pos -= s->len;
 	    s->len = -s->body_len;
-	    s->pos = 0;
 	}
         if (me->verbose) fprintf(stderr, "written2 %d/%d\n", s->pos, -s->len);
 	if (s->pos == -s->len) { /* body sent, close */
 write_done:
 	    if (me->verbose) fprintf(stderr, "reply complete\n");
-	    /* the kindle wants shutdown before close */
-	    shutdown(s->socket, SHUT_RDWR);
-	    close(s->socket);
-	    s->len = 0;
-	    if (s->filep) {
-		if (s->map) munmap(s->map, s->body_len);
-		close(s->filep);
-	    }
+	    sock_close(me, s);
 	}
     } else { /* accumulate request */
+	if (s->len - s->pos <= 0)	/* no room, do not read 0 bytes */
+	    return http_error(s, 431, "Request Header Fields Too Large");
 	l = read(s->socket, s->inbuf + s->pos, s->len - s->pos);
-	if (me->verbose) fprintf(stderr, "read %p returns %d %s\n", s, l, s->inbuf);
-	if (l <= 0) {
-	    fprintf(stderr, "buf [%s]\n", s->inbuf);
-	    s->len = 0; // mark done with read
-	} else {
-	    s->pos += l;
+	if (me->verbose) fprintf(stderr, "read %p returns %d %.*s\n",
+		s, l, l > 0 ? l : 0, s->inbuf + s->pos);
+	if (l < 0 && (errno == EAGAIN || errno == EINTR))
+	    return 0;
+	if (l <= 0) {	/* incomplete request, drop it */
+	    sock_close(me, s);
+	    return 0;
 	}
-	parse_msg(me, s); /* check if msg is complete */
+	s->pos += l;
+	s->inbuf[s->pos] = '\0';
+	sock_parse(me, s); /* check if msg is complete */
     }
     return 0;
 }
@@ -672,10 +1733,11 @@ int shell_keyboard(struct my_args *me, struct my_sess *sh)
 {
     int l;
     l = write(sh->master, sh->keys, sh->klen);
-    if (l <= 0)
+    if (l <= 0)	/* EAGAIN if the child is not reading */
 	return 1;
-    strcpy(sh->keys, sh->keys + l);
+    sh->bytes_in += l;
     sh->klen -= l;
+    memmove(sh->keys, sh->keys + l, sh->klen);
     return 0;
 }
 
@@ -684,21 +1746,89 @@ int shell_screen(struct my_args *me, struct my_sess *p)
 {
     int l, spos;
     char *s;
+    struct timeval t0, t1;
 
     spos = strlen(p->sbuf);
-    l = read(p->master, p->sbuf + spos, sizeof(p->sbuf) - 1 - spos);
+    l = sizeof(p->sbuf) - 1 - spos;
+    if (me->pty_rate && l > p->tokens)
+	l = p->tokens;
+    l = read(p->master, p->sbuf + spos, l);
+    if (l < 0 && (errno == EAGAIN || errno == EINTR))
+	return 0;
     if (l <= 0) {
         fprintf(stderr, "--- screen gives %d\n", l);
+	close(p->master);
 	p->master = -1;
 	return 1;
     }
+    p->tokens -= l;
+    p->bytes_out += l;
     spos += l;
     p->sbuf[spos] = '\0';
+    p->last_out = me->msec;
+    if (++p->gen == 0)
+	p->gen = 1;	/* 0 means no If-None-Match */
+    gettimeofday(&t0, NULL);
     s = page_append(p, p->sbuf); /* returns unprocessed pointer */
+    gettimeofday(&t1, NULL);
+    p->parse_us += (t1.tv_sec - t0.tv_sec) * 1000000LL + t1.tv_usec - t0.tv_usec;
     strcpy(p->sbuf, s);
     return 0;
 }
 
+/*
+ * Token bucket for reads from the pty, so a shell that produces
+ * output at full speed cannot take the loop from the others.
+ * We earn pty_rate tokens per second, up to a quarter second
+ * worth (and at least one read). Returns the tokens available.
+ */
+int sess_tokens(struct my_args *me, struct my_sess *p)
+{
+    long long add;
+    int burst;
+
+    if (!me->pty_rate)
+	return SMAX;
+    add = (me->msec - p->refill) * me->pty_rate / 1000;
+    if (add > 0) {
+	burst = me->pty_rate / 4 > SMAX ? me->pty_rate / 4 : SMAX;
+	p->tokens = p->tokens + add > burst ? burst : p->tokens + add;
+	p->refill = me->msec;
+    }
+    return p->tokens;
+}
+
+/* collect the children that exited, and log what they used */
+void reap_children(struct my_args *me)
+{
+    struct rusage ru;
+    int pid, status;
+
+    while ((pid = wait4(-1, &status, WNOHANG, &ru)) > 0) {
+	fprintf(stderr, "-- child %d exited status %d, cpu %ld.%03ld user"
+	    " %ld.%03ld sys, maxrss %ld\n", pid, status,
+	    (long)ru.ru_utime.tv_sec, (long)ru.ru_utime.tv_usec / 1000,
+	    (long)ru.ru_stime.tv_sec, (long)ru.ru_stime.tv_usec / 1000,
+	    ru.ru_maxrss);
+	if (me->cgroup) {	/* fails if something it started still runs */
+	    char dir[256];
+
+	    snprintf(dir, sizeof(dir), "%s/%d", me->cgroup, pid);
+	    if (rmdir(dir) && errno != ENOENT)
+		perror(dir);
+	}
+    }
+}
+
+void clock_update(struct my_args *me)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    me->now = tv.tv_sec;
+    me->msec = tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+}
+
 /*
  * Main loop implementing web server and connection handling
  */
@@ -710,43 +1840,89 @@ int mainloop(struct my_args *me)
 
     for (;;) {
 	int n, nmax;
+	time_t then;
 	struct my_sock *s, *nexts, **ps;
 	struct my_sess *p, *nextp, **pp;
 	fd_set r, w;
-	struct timeval to = { 5, 0 };
+	struct timeval to = { me->socks ? 1 : 5, 0 }; /* check deadlines */
 
 	FD_ZERO(&r);
 	FD_ZERO(&w);
-	FD_SET(me->lfd, &r);
+	for (p = me->sess; p; p = p->next) {
+	    p->busy = 0;
+	    p->inflight = 0;
+	}
+	for (s = me->socks; s; s = s->next) { /* reply backlog */
+	    if (s->reply && s->sess)
+		s->sess->inflight += sock_pending(s);
+	}
+	for (s = me->socks; s; s = s->next) {
+	    /* a complete request waits for its session's replies,
+	     * a partial one for room in the key queue
+	     */
+	    if (s->stalled && (s->pstate == PS_DONE ?
+		    !sess_stuck(me, s->sess) : s->sess->klen < KMAX)) {
+		s->deadline = me->now + me->timeout;
+		sock_parse(me, s);	/* resume */
+		if (s->reply && s->sess)
+		    s->sess->inflight += sock_pending(s);
+	    }
+	    if (s->reply && s->sess)
+		s->sess->busy = 1;
+	}
 	nmax = me->lfd;
+	FD_SET(me->lfd, &r);
 	for (s = me->socks; s; s = s->next) { /* handle sockets */
+	    if (s->stalled)
+		continue;
 	    FD_SET(s->socket, s->reply ? &w : &r);
 	    if (nmax < s->socket)
 		nmax = s->socket;
 	}
 	for (p = me->sess; p; p = p->next) {	/* handle terminals */
-	    FD_SET(p->master, &r);
+	    if (sess_tokens(me, p) <= 0) {	/* over its rate, wait */
+		p->throttled++;
+		to.tv_sec = 0;
+		to.tv_usec = 100000;
+	    } else if (!p->busy) { /* read only when the last screen is sent */
+		FD_SET(p->master, &r);
+	    }
 	    if (nmax < p->master)
 		nmax = p->master;
 	    if (p->klen)	/* have bytes to send to keyboard */
 		FD_SET(p->master, &w);
 	}
+	then = me->now;
 	n = select(nmax + 1, &r, &w, NULL, &to);
-	if (n == 0) {
+	clock_update(me);
+	reap_children(me);
+	for (s = me->socks; s; s = s->next) {
+	    /* time waiting for other replies does not count */
+	    if (s->stalled && s->pstate == PS_DONE)
+		s->deadline += me->now - then;
+	}
+	if (n == 0 && me->verbose)
 	    fprintf(stderr, "select returns %d\n", n);
-	    continue;
+	if (n < 0) {
+	    FD_ZERO(&r);
+	    FD_ZERO(&w);
 	}
 	if (FD_ISSET(me->lfd, &r))
 	    handle_listen(me);
 	for (ps = &me->socks, s = *ps; s; s = nexts) { /* scan sockets */
 	    nexts = s->next;
-	    if (FD_ISSET(s->socket, s->reply ? &w : &r))
+	    if (!s->stalled && FD_ISSET(s->socket, s->reply ? &w : &r))
 		sock_io(me, s);
+	    if (s->len != 0 && me->now > s->deadline) {
+		fprintf(stderr, "connection %p timed out\n", s);
+		sock_close(me, s);
+	    }
 	    if (s->len != 0) { /* socket still active */
 		ps = &s->next;
 	    } else { /* socket dead, unlink */
 		*ps = s->next;
-		free(s);
+		sock_free(me, s);
+		me->nsocks--;
 	    }
 	}
 	for (pp = &me->sess, p = *pp; p ; p = nextp) { /* scan shells */
@@ -760,27 +1936,58 @@ int mainloop(struct my_args *me)
 	    } else { /* dead session, unlink */
 		*pp = p->next;
 		fprintf(stderr, "-- free session %p ---\n", p);
-		free(p);
+		for (s = me->socks; s; s = s->next) {
+		    if (s->sess != p)
+			continue;
+		    s->sess = NULL;	/* request in progress, fail it */
+		    if (!s->reply)
+			http_error(s, 410, "Gone");
+		}
+		sess_free(me, p);
+		me->nsess--;
 	    }
 	}
     }
     return 0;
 }
 
+/* parse a size with an optional k or m suffix */
+long getsize(const char *s)
+{
+    char *end;
+    long l = strtol(s, &end, 10);
+
+    if (*end == 'k' || *end == 'K')
+	l *= 1024;
+    else if (*end == 'm' || *end == 'M')
+	l *= 1024*1024;
+    return l;
+}
+
 int main(int argc, char *argv[])
 {
     struct my_args me;
+    int i;
 
     bzero(&me, sizeof(me));
     me.sa.sin_family = PF_INET;
     me.sa.sin_port = htons(8022);
     inet_aton("127.0.0.1", &me.sa.sin_addr);
     me.cmd = "login";
+    me.timeout = 30;
+    me.history = 1000;
+    me.max_poll = 10000;
+    clock_update(&me);
+    signal(SIGPIPE, SIG_IGN);	/* clients may go away at any time */
     for ( ; argc > 1 ; argc--, argv++) {
 	if (!strcmp(argv[1], "--unsafe")) {
 	    me.unsafe = 1;
 	    continue;
 	}
+	if (!strcmp(argv[1], "--admin")) {
+	    me.admin = 1;
+	    continue;
+	}
 	if (!strcmp(argv[1], "--verbose")) {
 	    me.verbose = 1;
 	    continue;
@@ -791,6 +1998,54 @@ int main(int argc, char *argv[])
     	    me.cmd = argv[2];
 	    argc--; argv++; continue;
 	}
+	if (!strcmp(argv[1], "--max-memory")) {
+    	    me.max_memory = getsize(argv[2]);
+	    argc--; argv++; continue;
+	}
+	if (!strcmp(argv[1], "--max-sessions")) {
+    	    me.max_sessions = atoi(argv[2]);
+	    argc--; argv++; continue;
+	}
+	if (!strcmp(argv[1], "--history")) {
+    	    me.history = atoi(argv[2]);
+	    argc--; argv++; continue;
+	}
+	if (!strcmp(argv[1], "--pty-rate")) {
+    	    me.pty_rate = getsize(argv[2]);
+	    argc--; argv++; continue;
+	}
+	if (!strcmp(argv[1], "--rlimit-cpu")) {
+    	    me.rlimit_cpu = atoi(argv[2]);
+	    argc--; argv++; continue;
+	}
+	if (!strcmp(argv[1], "--rlimit-as")) {
+    	    me.rlimit_as = getsize(argv[2]);
+	    argc--; argv++; continue;
+	}
+	if (!strcmp(argv[1], "--cgroup")) {
+    	    me.cgroup = argv[2];
+	    argc--; argv++; continue;
+	}
+	if (!strcmp(argv[1], "--cgroup-cpu")) {
+    	    me.cgroup_cpu = atoi(argv[2]);
+	    argc--; argv++; continue;
+	}
+	if (!strcmp(argv[1], "--cgroup-mem")) {
+    	    me.cgroup_mem = getsize(argv[2]);
+	    argc--; argv++; continue;
+	}
+	if (!strcmp(argv[1], "--max-poll")) {
+    	    me.max_poll = atoi(argv[2]);
+	    argc--; argv++; continue;
+	}
+	if (!strcmp(argv[1], "--timeout")) {
+    	    me.timeout = atoi(argv[2]);
+	    argc--; argv++; continue;
+	}
+	if (!strcmp(argv[1], "--max-inflight")) {
+    	    me.max_inflight = getsize(argv[2]);
+	    argc--; argv++; continue;
+	}
 	if (!strcmp(argv[1], "--port")) {
     	    me.sa.sin_port = htons(atoi(argv[2]));
 	    argc--; argv++; continue;
@@ -807,6 +2062,13 @@ int main(int argc, char *argv[])
 	}
 	break;
     }
+    pool_init(&me.sockpool, sizeof(struct my_sock));
+    pool_init(&me.sesspool, sizeof(struct my_sess));
+    pool_init(&me.iopool, SOCKBUFSZ);
+    for (i = 0; i < NBUFCLASS; i++)
+	pool_init(&me.bufpool[i], 1 << (BUFMIN + i));
+    if (me.cgroup)
+	cgroup_init(&me);
     mainloop(&me);
     return 0;
 }
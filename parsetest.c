@@ -0,0 +1,348 @@
+/*
+ * $Id$
+ *
+ * Fuzz and throughput driver for the request parser in myts.c.
+ * It includes the server and feeds parse_msg() the same way
+ * sock_io() does, but from memory, split at random points.
+ * The shell side is a fake session "fz" whose key queue we drain
+ * when the parser stalls, so no child is ever forked.
+ *
+ *	cc -g -fsanitize=address,undefined -o parsetest parsetest.c -lutil
+ *	./parsetest [iterations [seed]]
+ *
+ * Run it from this directory, GET / needs ajaxterm.html.
+ * It checks a set of known requests with many splits, then fuzzes
+ * mutated requests, then reports the parser throughput.
+ * Exit status is 0 if all checks pass.
+ */
+
+#define main myts_main
+#include "myts.c"
+#undef main
+
+#define	KEYMAX	(32*1024*1024)	/* keys collected from one request */
+
+static struct my_args me;
+static struct my_sess *fz;	/* the fake session */
+static char *keys;		/* keys drained from fz */
+static int nkeys;
+static int failures;
+
+/* build the fake session, like sess_find() but without a child */
+static void fake_session(void)
+{
+    int l1 = 25*80 + 1;
+
+    fz = pool_get(&me, &me.sesspool);
+    fz->bufsz = l1*2 + 3;
+    fz->name = buf_get(&me, fz->bufsz);
+    strcpy(fz->name, "fz");
+    fz->rows = 25;
+    fz->cols = 80;
+    fz->page = fz->name + 3;
+    fz->oldpage = fz->page + l1;
+    memset(fz->page, ' ', l1 - 1);
+    fz->gen = 1;
+    fz->master = -1;
+    me.sess = fz;
+    me.nsess = 1;
+    me.max_sessions = 1;	/* other names get 503, never fork */
+}
+
+static void drain(void)
+{
+    int l = fz->klen;
+
+    if (nkeys + l > KEYMAX)
+	l = KEYMAX - nkeys;
+    memcpy(keys + nkeys, fz->keys, l);
+    nkeys += l;
+    fz->klen = 0;
+}
+
+static int check_state(struct my_sock *s)
+{
+    return s->pos >= 0 && s->pos <= s->len && s->scan >= 0 &&
+	s->scan <= s->pos && s->hlen <= s->pos;
+}
+
+/*
+ * Feed n bytes of req to a new connection in reads of 1..maxchunk
+ * bytes. Returns the status code of the reply, 0 if the input ended
+ * without one, -1 if the parser state went bad.
+ */
+static int run(const char *req, int n, int maxchunk)
+{
+    struct my_sock *s = sock_new(&me, -1);
+    int off = 0, l, code = 0;
+
+    nkeys = 0;
+    while (!s->reply) {
+	if (s->stalled) {	/* the shell reads the keys, resume */
+	    drain();
+	    parse_msg(&me, s);
+	    continue;
+	}
+	if (off == n)
+	    break;
+	l = 1 + random() % maxchunk;
+	if (l > n - off)
+	    l = n - off;
+	if (l > s->len - s->pos)
+	    l = s->len - s->pos;
+	if (l <= 0) {
+	    code = -1;	/* sock_io() would read 0 bytes */
+	    break;
+	}
+	memcpy(s->inbuf + s->pos, req + off, l);
+	s->pos += l;
+	s->inbuf[s->pos] = '\0';
+	off += l;
+	parse_msg(&me, s);
+	if (!s->reply && !check_state(s)) {
+	    code = -1;
+	    break;
+	}
+    }
+    drain();
+    if (s->reply && code == 0)
+	code = atoi(s->outbuf + 9);	/* HTTP/1.1 xxx */
+    sock_close(&me, s);
+    sock_free(&me, s);
+    return code;
+}
+
+/* run a request with several split patterns, check code and keys */
+static void expect(const char *name, const char *req, int n,
+	int code, const char *k, int klen)
+{
+    static const int chunks[] = { 1, 2, 7, 64, 1448, 65536 };
+    int i, j, got;
+
+    if (n < 0)
+	n = strlen(req);
+    if (k && klen < 0)
+	klen = strlen(k);
+    for (i = 0; i < sizeof(chunks)/sizeof(chunks[0]); i++) {
+	for (j = 0; j < 4; j++) {
+	    got = run(req, n, chunks[i]);
+	    if (got != code) {
+		printf("FAIL %s: split %d got %d want %d\n",
+		    name, chunks[i], got, code);
+		failures++;
+		return;
+	    }
+	    if (k && (nkeys != klen || memcmp(keys, k, klen))) {
+		printf("FAIL %s: split %d keys %d bytes want %d\n",
+		    name, chunks[i], nkeys, klen);
+		failures++;
+		return;
+	    }
+	}
+    }
+    printf("ok   %s\n", name);
+}
+
+/* urlencode src into dst, returns the length */
+static int encode(char *dst, const char *src, int n)
+{
+    char *d = dst;
+    int i;
+
+    for (i = 0; i < n; i++) {
+	unsigned char c = src[i];
+	if (isalnum(c))
+	    *d++ = c;
+	else if (c == ' ')
+	    *d++ = '+';
+	else
+	    d += sprintf(d, "%%%02X", c);
+    }
+    return d - dst;
+}
+
+/* a POST /u carrying keys k, with Content-Length or chunked */
+static int post(char *dst, const char *k, int n, int chunked)
+{
+    char *body = malloc(n*3 + 64), *d = dst;
+    int l, i, c;
+
+    l = sprintf(body, "s=fz&w=80&h=25&d=1&c=1&k=");
+    l += encode(body + l, k, n);
+    if (!chunked) {
+	d += sprintf(d, "POST /u HTTP/1.1\r\nContent-Length: %d\r\n\r\n", l);
+	memcpy(d, body, l);
+	d += l;
+    } else {
+	d += sprintf(d, "POST /u HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n");
+	for (i = 0; i < l; i += c) {
+	    c = 1 + random() % 300;
+	    if (c > l - i)
+		c = l - i;
+	    d += sprintf(d, "%x%s\r\n", c, (i & 1) ? ";ext=1" : "");
+	    memcpy(d, body + i, c);
+	    d += c;
+	    d += sprintf(d, "\r\n");
+	}
+	d += sprintf(d, "0\r\nX-Trailer: 1\r\n\r\n");
+    }
+    free(body);
+    return d - dst;
+}
+
+static const char *corpus[] = {
+    "GET / HTTP/1.0\r\n\r\n",
+    "GET /u?s=fz&w=80&h=25&k=ls%0a HTTP/1.1\r\nHost: x\r\n\r\n",
+    "POST /u HTTP/1.1\r\nContent-Length: 17\r\n\r\ns=fz&d=1&k=a%2Bb",
+    "POST /u HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+	"4\r\ns=fz\r\n5;x\r\n&k=ab\r\n0\r\n\r\n",
+    "POST /u HTTP/1.1\r\nIf-None-Match: \"3\"\r\nContent-Length: 4\r\n\r\ns=fz",
+    NULL
+};
+
+/* random byte flips, insertions, deletions and truncation */
+static int mutate(char *dst, const char *src, int n)
+{
+    int i, m = 1 + random() % 8, p;
+
+    memcpy(dst, src, n);
+    for (i = 0; i < m; i++) {
+	p = n ? random() % n : 0;
+	switch (random() % 4) {
+	case 0:
+	    if (n) dst[p] = random();
+	    break;
+	case 1:
+	    memmove(dst + p + 1, dst + p, n - p);
+	    dst[p] = "\r\n:; 0fF%&=-"[random() % 12];
+	    n++;
+	    break;
+	case 2:
+	    if (n) {
+		memmove(dst + p, dst + p + 1, n - p - 1);
+		n--;
+	    }
+	    break;
+	case 3:
+	    n = p;
+	    break;
+	}
+    }
+    return n;
+}
+
+static double now(void)
+{
+    struct timeval t;
+
+    gettimeofday(&t, NULL);
+    return t.tv_sec + t.tv_usec / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    int iters = argc > 1 ? atoi(argv[1]) : 100000;
+    int i, n, code, codes[600];
+    char *req, *k, hdr[INBUFSZ + 64];
+    double t;
+
+    srandom(argc > 2 ? atoi(argv[2]) : getpid());
+    pool_init(&me.sockpool, sizeof(struct my_sock));
+    pool_init(&me.sesspool, sizeof(struct my_sess));
+    pool_init(&me.iopool, SOCKBUFSZ);
+    for (i = 0; i < NBUFCLASS; i++)
+	pool_init(&me.bufpool[i], 1 << (BUFMIN + i));
+    me.cmd = "/bin/false";
+    clock_update(&me);
+    fake_session();
+    keys = malloc(KEYMAX);
+    req = malloc(3*KEYMAX + 4096);
+    k = malloc(KEYMAX);
+    /* the server is chatty, sanitizers still report on fd 2 */
+    stderr = fopen("/dev/null", "w");
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    /* known requests */
+    expect("get file", "GET / HTTP/1.0\r\n\r\n", -1, 200, NULL, 0);
+    expect("get u", "GET /u?s=fz&w=80&h=25&k=echo+hi%0a HTTP/1.0\r\n\r\n",
+	-1, 200, "echo hi\n", -1);
+    expect("leading empty lines", "\r\n\nGET /u?s=fz&k=x HTTP/1.0\n\n",
+	-1, 200, "x", -1);
+    for (i = 0; i < 256; i++)
+	k[i] = i;
+    n = post(req, k, 256, 0);
+    expect("post all bytes", req, n, 200, k, 256);
+    n = post(req, k, 256, 1);
+    expect("post chunked", req, n, 200, k, 256);
+    for (i = 0; i < 200000; i++)
+	k[i] = 32 + random() % 95;
+    n = post(req, k, 200000, 0);
+    expect("post paste", req, n, 200, k, 200000);
+    n = post(req, k, 200000, 1);
+    expect("post chunked paste", req, n, 200, k, 200000);
+    expect("empty body", "POST /u HTTP/1.1\r\nContent-Length: 0\r\n\r\n",
+	-1, 200, "", 0);
+    expect("garbage", "GARBAGE\r\n\r\n", -1, 400, NULL, 0);
+    expect("no resource", "GET\r\n\r\n", -1, 400, NULL, 0);
+    expect("bad length", "POST /u HTTP/1.1\r\nContent-Length: -4\r\n\r\n",
+	-1, 400, NULL, 0);
+    expect("no length", "POST /u HTTP/1.1\r\n\r\ns=fz", -1, 411, NULL, 0);
+    expect("chunk overflow", "POST /u HTTP/1.1\r\nTransfer-Encoding: chunked"
+	"\r\n\r\n3FFFFFFFF\r\n", -1, 400, NULL, 0);
+    expect("bad chunk", "POST /u HTTP/1.1\r\nTransfer-Encoding: chunked"
+	"\r\n\r\nzz\r\n", -1, 400, NULL, 0);
+    expect("k before s", "GET /u?k=x&s=fz HTTP/1.0\r\n\r\n", -1, 400, NULL, 0);
+    expect("new session refused", "GET /u?s=other&k=x HTTP/1.0\r\n\r\n",
+	-1, 503, NULL, 0);
+    n = sprintf(hdr, "GET / HTTP/1.1\r\nX: ");
+    memset(hdr + n, 'a', INBUFSZ);
+    expect("header too large", hdr, n + INBUFSZ, 431, NULL, 0);
+    /* headers end exactly at INBUFSZ-1, then a body */
+    n = sprintf(hdr, "POST /u HTTP/1.1\r\nContent-Length: 9\r\nX: ");
+    memset(hdr + n, 'a', INBUFSZ - 1 - 4 - n);
+    n = INBUFSZ - 1 - 4;
+    n += sprintf(hdr + n, "\r\n\r\ns=fz&k=ab");
+    expect("header fills inbuf", hdr, n, 200, "ab", -1);
+
+    /* fuzz */
+    bzero(codes, sizeof(codes));
+    t = now();
+    for (i = 0; i < iters; i++) {
+	const char *src = corpus[random() % 5];
+	n = mutate(req, src, strlen(src));
+	code = run(req, n, 1 + random() % 64);
+	if (code < 0) {
+	    printf("FAIL fuzz: bad parser state on %.*s\n", n, req);
+	    failures++;
+	    break;
+	}
+	codes[code < 600 ? code : 0]++;
+    }
+    printf("fuzz %d requests in %.2f s:", i, now() - t);
+    for (i = 0; i < 600; i++)
+	if (codes[i])
+	    printf(" %d:%d", i, codes[i]);
+    printf("\n");
+
+    /* throughput */
+    n = post(req, "ls\n", 3, 0);
+    t = now();
+    for (i = 0; i < 200000; i++)
+	run(req, n, 1448);
+    t = now() - t;
+    printf("small POST /u: %.0f requests/s\n", i / t);
+    for (i = 0; i < 16*1024*1024; i++)
+	k[i] = 32 + random() % 95;
+    n = post(req, k, i, 0);
+    t = now();
+    run(req, n, 1448);
+    t = now() - t;
+    printf("paste: %.1f MB of body in 1448 byte reads, %.1f MB/s\n",
+	n / 1e6, n / 1e6 / t);
+
+    free(req);
+    free(k);
+    free(keys);
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+    return failures ? 1 : 0;
+}